@@ -0,0 +1,343 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 6502 C Compiler implementation.
+ *
+ * 6502 C Compiler is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * 6502 C Compiler is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the 6502 C Compiler. If not, see <https:// www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Preprocessing one file under several command line configurations at once.
+ * 
+ * Phases 1-3 run once per file.  Phase 4 runs once per group of configurations that are still
+ * in the same state, starting with a single group.  A group shares its macro table (copied
+ * before it is changed while shared) and holds back the macros its configurations disagree on.
+ * Only when a line consults one of those (an #ifdef, #ifndef or a macro reached by expanding
+ * a line of text) is the group split by the value it has in each configuration; a #define or
+ * #undef of it settles the disagreement without a split.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "helpers.h"
+#include "prefetch.h"
+#include "preprocess.h"
+#include "configurations.h"
+
+typedef std::optional<std::vector<std::string>> MacroDefinition;
+
+struct ConfigurationGroup {
+    std::vector<size_t> members;           /* indexes into the configurations */
+    std::shared_ptr<MacroTable> macros;    /* shared between groups until one changes it */
+    std::set<std::string, std::less<>> unresolved;  /* macros the members disagree on, not in macros */
+    ConditionalState conditional;
+    std::string output;
+};
+
+void add_definition(Configuration &configuration, std::string_view definition) {
+    size_t equals = definition.find('=');
+    std::string_view identifier = definition.substr(0, equals);
+    if (!is_valid_identifier(identifier)) {
+        std::string message;
+        message = "Identifier Expected : ";
+        message.append(identifier);
+        throw std::invalid_argument(message);
+    }
+
+    std::vector<std::string> replacement;
+    if (equals == std::string_view::npos) {
+        replacement.push_back("1");
+    }
+    else {
+        std::string tokens(definition.substr(equals + 1));
+        tokens.push_back('\n');
+        replace_digraphs(tokens);
+        splice_lines(tokens);
+        tokens = tokenize(tokens);
+        size_t i = 0;
+        std::string_view token = next_token(tokens, i);
+        while (token.length() > 0) {
+            replacement.emplace_back(token);
+            token = next_token(tokens, i);
+        }
+    }
+    configuration.definitions[std::string(identifier)] = replacement;
+}
+
+void add_undefinition(Configuration &configuration, std::string_view identifier) {
+    if (!is_valid_identifier(identifier)) {
+        std::string message;
+        message = "Identifier Expected : ";
+        message.append(identifier);
+        throw std::invalid_argument(message);
+    }
+    configuration.definitions[std::string(identifier)] = std::nullopt;
+}
+
+void _set_macro(MacroTable &table, std::string_view identifier, const MacroDefinition &definition) {
+    if (definition) define_macro(table, identifier, *definition);
+    else undefine_macro(table, identifier);
+}
+
+void define_configuration_macros(const Configuration &configuration, MacroTable &table) {
+    for (const auto &definition : configuration.definitions) {
+        _set_macro(table, definition.first, definition.second);
+    }
+}
+
+MacroDefinition _definition_in(const Configuration &configuration, std::string_view identifier) {
+    auto definition = configuration.definitions.find(identifier);
+    if (definition == configuration.definitions.end()) return std::nullopt;
+    return definition->second;
+}
+
+/* Give the group a macro table of its own, if it shares one */
+void _detach(ConfigurationGroup &group) {
+    if (group.macros.use_count() > 1) group.macros = std::make_shared<MacroTable>(*group.macros);
+}
+
+void _fold(ConfigurationGroup &group, std::string_view identifier, const MacroDefinition &definition) {
+    _detach(group);
+    _set_macro(*group.macros, identifier, definition);
+    group.unresolved.erase(group.unresolved.find(identifier));
+}
+
+/* A group of one has nothing left to disagree on */
+void _fold_single(ConfigurationGroup &group, const std::vector<Configuration> &configurations) {
+    if (group.members.size() != 1) return;
+    while (!group.unresolved.empty()) {
+        std::string identifier = *group.unresolved.begin();
+        _fold(group, identifier, _definition_in(configurations[group.members[0]], identifier));
+    }
+}
+
+/**
+ * Split groups[g] by the definition its members have for identifier.  The first part stays
+ * at g, the others are appended.
+ */
+void _resolve(std::vector<ConfigurationGroup> &groups, size_t g, const std::string &identifier,
+              const std::vector<Configuration> &configurations) {
+    std::vector<MacroDefinition> definitions;
+    std::vector<std::vector<size_t>> parts;
+    for (size_t member : groups[g].members) {
+        MacroDefinition definition = _definition_in(configurations[member], identifier);
+        auto found = std::find(definitions.begin(), definitions.end(), definition);
+        if (found == definitions.end()) {
+            definitions.push_back(definition);
+            parts.emplace_back();
+            found = definitions.end() - 1;
+        }
+        parts[found - definitions.begin()].push_back(member);
+    }
+
+    for (size_t part = 1; part < parts.size(); part++) {
+        ConfigurationGroup split = groups[g];
+        groups.push_back(std::move(split));
+        groups.back().members = parts[part];
+        _fold(groups.back(), identifier, definitions[part]);
+        _fold_single(groups.back(), configurations);
+    }
+    groups[g].members = parts[0];
+    _fold(groups[g], identifier, definitions[0]);
+    _fold_single(groups[g], configurations);
+}
+
+/**
+ * First macro in unresolved that expanding token from a line of text would consult, going by
+ * the memoized lookups of token so the replacement lists are not walked for every line.
+ */
+bool _consults(std::string_view token, const ConfigurationGroup &group, std::string &identifier) {
+    if (group.unresolved.count(token)) {
+        identifier = token;
+        return true;
+    }
+    auto entry = group.macros->entries.find(token);
+    if (entry == group.macros->entries.end()) return false;
+    for (const std::string &looked_up : macro_lookups(*group.macros, token)) {
+        if (group.unresolved.count(looked_up)) {
+            identifier = looked_up;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* First macro the members of group disagree on that line depends on, false if none */
+bool _unresolved_in_line(std::string_view line, const ConfigurationGroup &group, std::string &identifier) {
+    if (group.unresolved.empty() || group.conditional.current_false) return false;
+    size_t i = 0;
+    std::string_view token = next_token(line, i);
+    if (token == "#") {
+        token = next_token(line, i);
+        if (token != "ifdef" && token != "ifndef") return false;
+        token = next_token(line, i);
+        if (!group.unresolved.count(token)) return false;
+        identifier = token;
+        return true;
+    }
+    while (token.length() > 0) {
+        if (_consults(token, group, identifier)) return true;
+        token = next_token(line, i);
+    }
+    return false;
+}
+
+void _execute_lines(std::string_view tokens, std::vector<ConfigurationGroup> &groups,
+                    const std::vector<Configuration> &configurations,
+                    std::map<std::string, std::string> &file_tokens);
+
+/* Phase 4 of an #include for groups[g], any groups it splits off are appended */
+void _execute_include(std::string_view filename, std::vector<ConfigurationGroup> &groups, size_t g,
+                      const std::vector<Configuration> &configurations,
+                      std::map<std::string, std::string> &file_tokens) {
+    std::string path = (current_path_ / filename).string();
+    auto tokens = file_tokens.find(path);
+    if (tokens == file_tokens.end()) {
+        std::string buffer = read_source_file(path.c_str());
+        translate_to_tokens(buffer);
+        tokens = file_tokens.emplace(path, std::move(buffer)).first;
+    }
+
+    ConditionalState outer = groups[g].conditional;
+    std::vector<ConfigurationGroup> included;
+    included.push_back(std::move(groups[g]));
+    included[0].conditional = ConditionalState();
+    _execute_lines(tokens->second, included, configurations, file_tokens);
+    release_prefetched_includes(path.c_str());
+
+    groups[g] = std::move(included[0]);
+    groups[g].conditional = outer;
+    for (size_t part = 1; part < included.size(); part++) {
+        groups.push_back(std::move(included[part]));
+        groups.back().conditional = outer;
+    }
+}
+
+/* Phase 4 of one line for groups[g], splitting the group first if the line needs it */
+void _execute_group_line(std::string_view line, std::vector<ConfigurationGroup> &groups, size_t g,
+                         const std::vector<Configuration> &configurations,
+                         std::map<std::string, std::string> &file_tokens) {
+    std::string identifier;
+    while (_unresolved_in_line(line, groups[g], identifier)) {
+        size_t first_split = groups.size();
+        _resolve(groups, g, identifier, configurations);
+        size_t end_split = groups.size();
+        for (size_t split = first_split; split < end_split; split++) {
+            _execute_group_line(line, groups, split, configurations, file_tokens);
+        }
+    }
+
+    size_t i = 0;
+    std::string_view token = next_token(line, i);
+    std::string_view directive, operand;
+    if (token == "#") {
+        directive = next_token(line, i);
+        operand = next_token(line, i);
+    }
+
+    if (directive == "include" && !groups[g].conditional.current_false) {
+        if (operand.length() > 0 && operand[0] == '"') {
+            _execute_include(operand.substr(1, operand.length() - 2), groups, g, configurations, file_tokens);
+            return;
+        }
+        _execute_include("", groups, g, configurations, file_tokens);
+        return;
+    }
+
+    ConfigurationGroup &group = groups[g];
+    bool changes_macros = (directive == "define" || directive == "undef") && !group.conditional.current_false;
+    if (changes_macros) _detach(group);
+
+    std::swap(macros, *group.macros);
+    try {
+        execute_directive_line(line, group.conditional, group.output);
+    }
+    catch (...) {
+        std::swap(macros, *group.macros);
+        throw;
+    }
+    std::swap(macros, *group.macros);
+
+    if (changes_macros) {
+        auto unresolved = group.unresolved.find(operand);
+        if (unresolved != group.unresolved.end()) group.unresolved.erase(unresolved);
+    }
+}
+
+void _execute_lines(std::string_view tokens, std::vector<ConfigurationGroup> &groups,
+                    const std::vector<Configuration> &configurations,
+                    std::map<std::string, std::string> &file_tokens) {
+    size_t i_start = 0;
+    size_t i_end = tokens.find('\n', i_start);
+    std::string_view line;
+    while (i_end != std::string_view::npos) {
+        line = tokens.substr(i_start, i_end - i_start);
+        /* groups split off while executing this line have already executed it */
+        size_t group_count = groups.size();
+        for (size_t g = 0; g < group_count; g++) {
+            _execute_group_line(line, groups, g, configurations, file_tokens);
+        }
+        i_start = i_end + 1;
+        i_end = tokens.find('\n', i_start);
+    }
+    for (const ConfigurationGroup &group : groups) check_conditionals_closed(group.conditional, line);
+}
+
+/**
+ * Preprocess filename once for each configuration, returning the outputs in the same order.
+ * Includes are resolved against current_path_.
+ */
+std::vector<std::string> preprocess_configurations(char* filename,
+                                                   const std::vector<Configuration> &configurations) {
+    std::map<std::string, std::string> file_tokens;  /* phase 1-3 output of each file read */
+    std::string buffer = read_source_file(filename);
+    translate_to_tokens(buffer);
+
+    /* macros every configuration agrees on start out defined, the rest are held back */
+    ConfigurationGroup group;
+    group.macros = std::make_shared<MacroTable>();
+    std::set<std::string, std::less<>> identifiers;
+    for (size_t member = 0; member < configurations.size(); member++) {
+        group.members.push_back(member);
+        for (const auto &definition : configurations[member].definitions) identifiers.insert(definition.first);
+    }
+    for (const std::string &identifier : identifiers) {
+        MacroDefinition definition = _definition_in(configurations[0], identifier);
+        bool agreed = true;
+        for (const Configuration &configuration : configurations) {
+            agreed = agreed && _definition_in(configuration, identifier) == definition;
+        }
+        if (agreed) _set_macro(*group.macros, identifier, definition);
+        else group.unresolved.insert(identifier);
+    }
+    _fold_single(group, configurations);
+
+    std::vector<ConfigurationGroup> groups;
+    groups.push_back(std::move(group));
+    _execute_lines(buffer, groups, configurations, file_tokens);
+    release_prefetched_includes(filename);
+
+    std::vector<std::string> outputs(configurations.size());
+    for (ConfigurationGroup &finished : groups) {
+        for (size_t member : finished.members) outputs[member] = finished.output;
+    }
+    return outputs;
+}
@@ -0,0 +1,25 @@
+#ifndef SRC_CONFIGURATIONS_H_
+#define SRC_CONFIGURATIONS_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <optional>
+
+#include "preprocess.h"
+
+/* Macros set on the command line, a replacement list for -D or nothing for -U */
+struct Configuration {
+    std::string name;
+    std::map<std::string, std::optional<std::vector<std::string>>, std::less<>> definitions;
+};
+
+void add_definition(Configuration &configuration, std::string_view definition);
+void add_undefinition(Configuration &configuration, std::string_view identifier);
+void define_configuration_macros(const Configuration &configuration, MacroTable &table);
+std::vector<std::string> preprocess_configurations(char* filename,
+                                                   const std::vector<Configuration> &configurations);
+
+
+#endif  // SRC_CONFIGURATIONS_H_
@@ -16,8 +16,9 @@
  */
 
 #include <string>
+#include <string_view>
+#include <cstring>
 #include <fstream>
-#include <sstream>
 #include <iostream>
 
 #include "language.h"
@@ -38,69 +39,61 @@ std::string get_file_contents(const char *filename) {
     throw(errno);
 }
 
-bool _is_in(const char *list, const char *item){
-    char search[strlen(item)+2];
-    strcpy(search, " ");
-    strcat(search, item);
-    strcat(search, " ");
-    return strstr(list, search) != NULL;    
+/* true if item appears in the space separated list, without building a search string */
+bool _is_in(std::string_view list, std::string_view item) {
+    size_t position = list.find(item);
+    while (position != std::string_view::npos) {
+        size_t after = position + item.length();
+        if (position > 0 && list[position-1] == ' ' && after < list.length() && list[after] == ' ') {
+            return true;
+        }
+        position = list.find(item, position + 1);
+    }
+    return false;
 }
 
-bool is_token_a_keyword(const char *token) {
+bool is_token_a_keyword(std::string_view token) {
     return _is_in(LANGUAGE_KEYWORDS, token);
 }
 
 bool is_char_a_non_digit(char character) {
-    char item[2] = " ";
-    item[0] = character;    
-    return _is_in(LANGUAGE_NONDIGIT, item);
+    return _is_in(LANGUAGE_NONDIGIT, std::string_view(&character, 1));
 }
 
 bool is_char_a_digit(char character) {
-    char item[2] = " ";
-    item[0] = character;    
-    return _is_in(LANGUAGE_DIGIT, item);
+    return _is_in(LANGUAGE_DIGIT, std::string_view(&character, 1));
 }
 
-bool is_token_an_operator(const char *token) {
+bool is_token_an_operator(std::string_view token) {
     return _is_in(LANGUAGE_OPERATORS, token);
 }
 
-bool is_token_a_punctuator(const char *token) {
+bool is_token_a_punctuator(std::string_view token) {
     return _is_in(LANGUAGE_PUNCTUATORS, token);
 }
 bool is_char_whitepsace(char character){
-    char item[2] = " ";
-    item[0] = character;
-    return _is_in(LANGUAGE_WHITESPACE, item);
+    return _is_in(LANGUAGE_WHITESPACE, std::string_view(&character, 1));
 }
 
 bool _is_hex_digit(char character) {
-    char item[2] = " ";
-    item[0] = character;
-    return _is_in(LANGAUGE_HEX_DIGITS, item);    
+    return _is_in(LANGAUGE_HEX_DIGITS, std::string_view(&character, 1));
 }
 
 bool _is_octal_digit(char character) {
-    char item[2] = " ";
-    item[0] = character;
-    return _is_in(LANGAUGE_OCTAL_DIGITS, item);    
+    return _is_in(LANGAUGE_OCTAL_DIGITS, std::string_view(&character, 1));
 }
 
 
 bool _is_char_in_source_character_set(char character) {
-    char item[2] = " ";
-    item[0] = character;
-    return _is_in(LANGUAGE_SOURCE_CARACTER_SET, item);    
+    return _is_in(LANGUAGE_SOURCE_CARACTER_SET, std::string_view(&character, 1));
 }
 
 
-int _is_escape_sequence_at(std::string token, int index) {
+int _is_escape_sequence_at(std::string_view token, size_t index) {
     if (token.length() <= index+1 ) return 0;
-    if (index < 0) return 0;
     if (token[index] != '\\') return 0;
     
-    int i;
+    size_t i;
 
     switch (token[index+1])
     {
@@ -138,25 +131,25 @@ int _is_escape_sequence_at(std::string token, int index) {
 }
 
 
-bool is_valid_identifier(std::string token) {
+bool is_valid_identifier(std::string_view token) {
     if(token.length() < 1) return false;
-    if(is_token_a_keyword(token.c_str())) return false;
+    if(is_token_a_keyword(token)) return false;
     if(!is_char_a_non_digit(token[0])) return false;
-    for(int i = 1; i < token.length(); i++){
+    for(size_t i = 1; i < token.length(); i++){
         if(!(is_char_a_non_digit(token[i]) || is_char_a_digit(token[i]))) return false;
     }
     return true;
 }
 
-bool is_valid_header_name(std::string token) {
-    if (token[0] != '<' ) return false;
-    for (int i = 1; i < token.length(); i++) {
+bool is_valid_header_name(std::string_view token) {
+    if (token.length() < 1 || token[0] != '<' ) return false;
+    for (size_t i = 1; i < token.length(); i++) {
         if (token[i] == '>' && i != token.length()-1) return false;
         if (token[i] == '\n') return false;
         if (token[i] == '\\') {
             int consumed = _is_escape_sequence_at(token, i);
             if (consumed > 0) {
-                i += consumed;
+                i += consumed - 1;  /* loop steps past the last character */
             }
             else return false;
         }
@@ -170,15 +163,15 @@ bool is_valid_header_name(std::string token) {
 }
 
 
-bool is_valid_string_literal(std::string token) {
-    if (token[0] != '"' ) return false;
-    for (int i = 1; i < token.length(); i++) {
+bool is_valid_string_literal(std::string_view token) {
+    if (token.length() < 1 || token[0] != '"' ) return false;
+    for (size_t i = 1; i < token.length(); i++) {
         if (token[i] == '"' && i != token.length()-1) return false;
         if (token[i] == '\n') return false;
         if (token[i] == '\\') {
             int consumed = _is_escape_sequence_at(token, i);
             if (consumed > 0) {
-                i += consumed;
+                i += consumed - 1;  /* loop steps past the last character */
             }
             else return false;
         }
@@ -191,53 +184,50 @@ bool is_valid_string_literal(std::string token) {
     return true;
 }
 
-bool is_valid_character_constant(std::string token) {
-    if (token[0] != '\'' ) return false;
-    for (int i = 1; i < token.length(); i++) {
+bool is_valid_character_constant(std::string_view token) {
+    if (token.length() < 1 || token[0] != '\'' ) return false;
+    for (size_t i = 1; i < token.length(); i++) {
         if (token[i] == '\'' && i != token.length()-1) return false;
         if (token[i] == '\n') return false;
         if (token[i] == '\\') {
             int consumed = _is_escape_sequence_at(token, i);
             if (consumed > 0) {
-                i += consumed;
+                i += consumed - 1;  /* loop steps past the last character */
             }        
             else return false;
         }
         else if (!_is_char_in_source_character_set(token[i])) return false;
     }
-    if (token[token.length()-1] != '\'') return true;
+    if (token[token.length()-1] != '\'') return false;
     return true;
 }
 
 
-std::string get_next_token(std::string &in_buffer, int &index) {
-    std::stringstream token;
+/* Returns a view into in_buffer, valid as long as in_buffer is */
+std::string_view next_token(std::string_view in_buffer, size_t &index) {
     /* skip whitespace */
     while(index < in_buffer.length() && is_char_whitepsace(in_buffer[index])) index++;
-    if(index >= in_buffer.length()) return token.str();
+    if(index >= in_buffer.length()) return std::string_view();
+
+    size_t start = index;
     if(in_buffer[index] == '"' || in_buffer[index] == '\'') { /* string or character literal */
         char terminator = in_buffer[index];
 
-        token << in_buffer[index];
-
         index++;
         while(index < in_buffer.length() && (in_buffer[index] != terminator || 
                                             (in_buffer[index-1] == '\\' && in_buffer[index-2] != '\\'))) {  
-            token << in_buffer[index];
             index++;
         }
-        if(in_buffer[index] == terminator) {
-            token << in_buffer[index];
+        if(index < in_buffer.length() && in_buffer[index] == terminator) {
             index++;
-            return token.str();
+            return in_buffer.substr(start, index - start);
         }
-        return std::string();
+        return std::string_view();
     }
 
     /* if not a string/character literal */
     while(index < in_buffer.length() && !is_char_whitepsace(in_buffer[index])) {
-        token << in_buffer[index];
         index++;
     }
-    return token.str();   
+    return in_buffer.substr(start, index - start);
 }
@@ -0,0 +1,393 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 6502 C Compiler implementation.
+ *
+ * 6502 C Compiler is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * 6502 C Compiler is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the 6502 C Compiler. If not, see <https:// www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Incremental preprocessing, for editors that re-run the preprocessor on every keystroke.
+ * 
+ * The source is kept as a list of logical lines (segments), each with its phase 3 tokens and
+ * the range of the output it produced.  An edit re-lexes only the segments it touches, and
+ * the ones after it up to the point where segment boundaries line up again (an edit that
+ * opens a comment runs on until the comment closes).  When neither the old nor the new text
+ * of the edited segments holds a directive, the macro table and conditional state in effect
+ * are known, so only those segments are expanded again and their output is patched in place.
+ * Otherwise phase 4 is re-run from the tokens already held, starting at the last macro table
+ * checkpoint before the edit.
+ *
+ * Checkpoints are copies of the macro table, taken at most once per as many directives as
+ * the table has entries (and at least CHECKPOINT_MIN_DIRECTIVES), so together they hold no
+ * more than one entry per directive.  The table in effect at any other segment is rebuilt
+ * by replaying the directives since the checkpoint before it.  The segment after an #include
+ * always gets a checkpoint, so a replay never reads and preprocesses an included file again.
+ *
+ * Phase 4 runs against a table of its own, the global macros table is left as it was.  If
+ * the edited source fails to preprocess the exception propagates and the result is left as
+ * it was.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+
+#include "helpers.h"
+#include "preprocess.h"
+#include "incremental.h"
+
+#define CHECKPOINT_MIN_DIRECTIVES 64
+
+/* Character at i after trigraph replacement (phase 1), width is set to the bytes it spans */
+char _logical_char(std::string_view source, size_t i, size_t &width) {
+    width = 1;
+    if (source[i] == '?' && i + 2 < source.length() && source[i+1] == '?') {
+        width = 3;
+        switch (source[i+2])
+        {
+        case '=': return '#';
+        case '/': return '\\';
+        case '\'': return '^';
+        case '(': return '[';
+        case ')': return ']';
+        case '!': return '|';
+        case '<': return '{';
+        case '>': return '}';
+        case '-': return '~';
+        default:
+            break;
+        }
+        width = 1;
+    }
+    return source[i];
+}
+
+/* Read the character at i after phases 1 and 2, advancing i past it and any splices before it */
+bool _read_logical(std::string_view source, size_t &i, char &character) {
+    while (i < source.length()) {
+        size_t width;
+        character = _logical_char(source, i, width);
+        if (character == '\\' && i + width < source.length() && source[i + width] == '\n') {
+            i += width + 1;  /* spliced */
+            continue;
+        }
+        i += width;
+        return true;
+    }
+    return false;
+}
+
+char _peek_logical(std::string_view source, size_t i) {
+    char character;
+    if (!_read_logical(source, i, character)) return 0;
+    return character;
+}
+
+/**
+ * Just past the first newline that tokenize() reaches outside of a comment, starting from a
+ * point where it is in its start of line state, which is where it resets that state again.
+ * This follows the order tokenize() tries things in, on the source text before phases 1 and 2.
+ */
+size_t _scan_logical_line(std::string_view source, size_t start) {
+    bool first_token = true;
+    bool directive = false;
+    size_t i = start;
+    char character, previous, before_previous;
+
+    while (_read_logical(source, i, character)) {
+        if (character == '/' && _peek_logical(source, i) == '*') {
+            _read_logical(source, i, previous);
+            /* tokenize() looks for the closing / from the character after the opening * */
+            while (_read_logical(source, i, character) && !(previous == '*' && character == '/')) {
+                previous = character;
+            }
+        }
+        else if (character == '/' && _peek_logical(source, i) == '/') {
+            while (_read_logical(source, i, character) && character != '\n') {}
+            return i;
+        }
+        else if (character == '\n') {
+            return i;
+        }
+        else if (character == '"' || (directive && character == '<') || character == '\'') {
+            char terminator = character == '<' ? '>' : character;
+            bool check_double_escape = character == '"';
+            before_previous = 0;
+            previous = character;
+            while (_read_logical(source, i, character)) {
+                if (character == '\n') return i;  /* unterminated, tokenize() reports it */
+                if (character == terminator && !(previous == '\\' &&
+                        !(check_double_escape && before_previous == '\\'))) break;
+                before_previous = previous;
+                previous = character;
+            }
+            first_token = false;
+        }
+        else if (!is_char_whitepsace(character)) {
+            if (first_token && character == '#' && _peek_logical(source, i) != '#') directive = true;
+            first_token = false;
+        }
+    }
+    return i;
+}
+
+/* End of the logical line starting at start, a tail of nothing but splices is taken along */
+size_t _logical_line_end(std::string_view source, size_t start) {
+    size_t end = _scan_logical_line(source, start);
+    size_t rest = end;
+    char character;
+    if (!_read_logical(source, rest, character)) return source.length();
+    return end;
+}
+
+/* Split source[start, end) into segments and run phases 1-3 on each */
+void _lex_segments(std::string_view source, size_t start, size_t end, std::vector<IncrementalSegment> &out) {
+    while (start < end) {
+        IncrementalSegment segment;
+        segment.source_offset = start;
+        segment.source_length = _logical_line_end(source, start) - start;
+        segment.tokens = source.substr(start, segment.source_length);
+        replace_digraphs(segment.tokens);
+        splice_lines(segment.tokens);
+        segment.tokens = tokenize(segment.tokens);
+        size_t i = 0;
+        segment.directive = next_token(segment.tokens, i) == "#";
+        start += segment.source_length;
+        out.push_back(std::move(segment));
+    }
+}
+
+std::string_view _line(const IncrementalSegment &segment) {
+    return std::string_view(segment.tokens).substr(0, segment.tokens.length() - 1);
+}
+
+/* An #include that phase 4 carries out, rather than skips in a false conditional */
+bool _reads_file(const IncrementalSegment &segment) {
+    if (!segment.directive || segment.conditional.current_false) return false;
+    size_t i = 0;
+    next_token(segment.tokens, i);
+    return next_token(segment.tokens, i) == "include";
+}
+
+/* Run one line through phase 4 with table standing in for the global macros table */
+void _execute_line(MacroTable &table, std::string_view line, ConditionalState &conditional, std::string &out) {
+    std::swap(macros, table);
+    try {
+        execute_directive_line(line, conditional, out);
+    }
+    catch (...) {
+        std::swap(macros, table);
+        throw;
+    }
+    std::swap(macros, table);
+}
+
+/**
+ * Run phase 4 over segments[first, end), starting from the given state, filling in each
+ * segment's state, checkpoint and output range.  The output is appended to out.
+ * segments[first] keeps the checkpoint it has, or gets one.
+ */
+void _execute_segments(std::vector<IncrementalSegment> &segments, size_t first, size_t output_offset,
+                       ConditionalState conditional, MacroTable &table, std::string &out) {
+    size_t out_start = out.length();
+    size_t directives = 0;  /* since the last checkpoint */
+    for (size_t index = first; index < segments.size(); index++) {
+        IncrementalSegment &segment = segments[index];
+        if (index > first) {
+            segment.macros = nullptr;
+            if (_reads_file(segments[index - 1]) ||
+                    directives >= std::max<size_t>(CHECKPOINT_MIN_DIRECTIVES, table.entries.size())) {
+                segment.macros = std::make_shared<MacroTable>(table);
+            }
+        }
+        else if (!segment.macros) {
+            segment.macros = std::make_shared<MacroTable>(table);
+        }
+        if (segment.macros) directives = 0;
+
+        segment.conditional = conditional;
+        segment.output_offset = output_offset + out.length() - out_start;
+        _execute_line(table, _line(segment), conditional, out);
+        segment.output_length = output_offset + out.length() - out_start - segment.output_offset;
+        if (segment.directive) directives++;
+    }
+    check_conditionals_closed(conditional, segments.empty() ? "" : _line(segments.back()));
+}
+
+/* Rebuild in table the macros in effect before segments[index], from the checkpoint before it */
+void _macros_before(const std::vector<IncrementalSegment> &segments, size_t index, MacroTable &table) {
+    size_t checkpoint = index;
+    while (!segments[checkpoint].macros) checkpoint--;  /* the first segment always has one */
+    table = *segments[checkpoint].macros;
+
+    ConditionalState conditional = segments[checkpoint].conditional;
+    std::string discarded;
+    for (size_t replayed = checkpoint; replayed < index; replayed++) {
+        if (!segments[replayed].directive) continue;  /* text can not change the table */
+        _execute_line(table, _line(segments[replayed]), conditional, discarded);
+        discarded.clear();
+    }
+}
+
+/**
+ * Preprocess source starting from the macros in predefined, keeping what preprocess_edit()
+ * needs.  Includes are resolved against current_path_.
+ */
+IncrementalResult preprocess_incremental(std::string source, MacroTable predefined) {
+    IncrementalResult result;
+    result.source = std::move(source);
+    _lex_segments(result.source, 0, result.source.length(), result.segments);
+
+    _execute_segments(result.segments, 0, 0, ConditionalState(), predefined, result.output);
+    return result;
+}
+
+/* Index of the segment holding offset, the last segment for the end of the source */
+size_t _segment_at(const std::vector<IncrementalSegment> &segments, size_t offset) {
+    size_t low = 0, high = segments.size();
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (segments[middle].source_offset <= offset) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+/**
+ * Replace removed bytes at offset in result.source with inserted, and bring the tokens and
+ * output up to date.  The cost is proportional to the edited lines, plus adjusting the
+ * offsets of the segments after them; only an edit touching a directive re-runs phase 4
+ * (from tokens) for the rest of the file.
+ */
+void preprocess_edit(IncrementalResult &result, size_t offset, size_t removed, std::string_view inserted) {
+    if (offset > result.source.length() || removed > result.source.length() - offset) {
+        std::string message;
+        message = "Edit outside of source: offset ";
+        message.append(std::to_string(offset));
+        message.append(" length ");
+        message.append(std::to_string(removed));
+        throw std::invalid_argument(message);
+    }
+    if (result.segments.empty()) {
+        std::string source = result.source;
+        source.replace(offset, removed, inserted);
+        result = preprocess_incremental(std::move(source));
+        return;
+    }
+
+    std::vector<IncrementalSegment> &segments = result.segments;
+    long delta = (long)inserted.length() - (long)removed;
+
+    /* old segments [first, last) are replaced */
+    size_t first = _segment_at(segments, offset);
+    size_t last = _segment_at(segments, offset + removed) + 1;
+
+    /* edit in place, the removed text is kept to undo it if preprocessing fails */
+    std::string &source = result.source;
+    std::string removed_text = source.substr(offset, removed);
+    source.replace(offset, removed, inserted);
+
+    /* a tail of nothing but splices belongs to the line before it */
+    size_t rest = segments[first].source_offset;
+    char character;
+    if (first > 0 && !_read_logical(source, rest, character)) first--;
+
+    /* re-lex until a segment boundary lines up with an old one past the edit */
+    std::vector<IncrementalSegment> lexed;
+    size_t start = segments[first].source_offset;
+    size_t edit_end = offset + inserted.length();
+    try {
+        while (start < source.length()) {
+            size_t end = _logical_line_end(source, start);
+            _lex_segments(source, start, end, lexed);
+            start = end;
+            while (last < segments.size() && (long)segments[last].source_offset + delta < (long)start) last++;
+            if (start >= edit_end && last < segments.size() &&
+                    (long)segments[last].source_offset + delta == (long)start) break;
+        }
+    }
+    catch (...) {
+        source.replace(offset, inserted.length(), removed_text);
+        throw;
+    }
+    if (start >= source.length()) last = segments.size();
+
+    bool directive_changed = false;
+    for (size_t index = first; index < last; index++) directive_changed |= segments[index].directive;
+    for (const IncrementalSegment &segment : lexed) directive_changed |= segment.directive;
+
+    size_t output_start = segments[first].output_offset;
+    size_t output_end = last < segments.size() ? segments[last].output_offset : result.output.length();
+
+    if (!directive_changed) {
+        /* lines of text only: same macros and conditionals as the first line replaced */
+        if (!result.edit_macros || result.edit_segment != first) {
+            result.edit_macros = std::make_shared<MacroTable>();
+            _macros_before(segments, first, *result.edit_macros);
+            result.edit_segment = first;
+        }
+        std::string output;
+        for (IncrementalSegment &segment : lexed) {
+            segment.conditional = segments[first].conditional;
+            segment.macros = nullptr;
+            segment.output_offset = output_start + output.length();
+            if (!segment.conditional.current_false) expand_line(_line(segment), *result.edit_macros, output);
+            segment.output_length = output_start + output.length() - segment.output_offset;
+        }
+        if (!lexed.empty()) lexed[0].macros = segments[first].macros;
+        long output_delta = (long)output.length() - (long)(output_end - output_start);
+
+        result.output.replace(output_start, output_end - output_start, output);
+        for (size_t index = last; index < segments.size(); index++) {
+            segments[index].source_offset += delta;
+            segments[index].output_offset += output_delta;
+        }
+        segments.erase(segments.begin() + first, segments.begin() + last);
+        segments.insert(segments.begin() + first, std::make_move_iterator(lexed.begin()),
+                        std::make_move_iterator(lexed.end()));
+        return;
+    }
+
+    /* a directive changed: re-run phase 4 from the last checkpoint before the edit */
+    size_t resume = first;
+    while (!segments[resume].macros) resume--;
+    MacroTable table = *segments[resume].macros;
+
+    std::vector<IncrementalSegment> updated;
+    for (size_t index = resume; index < first; index++) updated.push_back(segments[index]);
+    for (IncrementalSegment &segment : lexed) updated.push_back(std::move(segment));
+    for (size_t index = last; index < segments.size(); index++) {
+        updated.push_back(segments[index]);
+        updated.back().source_offset += delta;
+    }
+
+    std::string output;
+    try {
+        _execute_segments(updated, 0, segments[resume].output_offset, segments[resume].conditional,
+                          table, output);
+    }
+    catch (...) {
+        source.replace(offset, inserted.length(), removed_text);
+        throw;
+    }
+    result.edit_macros = nullptr;
+
+    result.output.replace(segments[resume].output_offset, std::string::npos, output);
+    segments.erase(segments.begin() + resume, segments.end());
+    segments.insert(segments.end(), std::make_move_iterator(updated.begin()),
+                    std::make_move_iterator(updated.end()));
+}
@@ -0,0 +1,40 @@
+#ifndef SRC_INCREMENTAL_H_
+#define SRC_INCREMENTAL_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+
+#include "preprocess.h"
+
+/**
+ * One logical source line: it starts and ends outside of any comment or literal and its
+ * final newline is not spliced, so it can be lexed on its own.  Its phase 3 output is
+ * exactly one line.
+ */
+struct IncrementalSegment {
+    size_t source_offset;
+    size_t source_length;
+    size_t output_offset;
+    size_t output_length;
+    std::string tokens;                  /* phase 3 output, including the newline */
+    bool directive;                      /* first token is # */
+    ConditionalState conditional;        /* in effect before this segment */
+    std::shared_ptr<MacroTable> macros;  /* checkpoint of the table in effect before this segment, or null */
+};
+
+struct IncrementalResult {
+    std::string source;
+    std::string output;
+    std::vector<IncrementalSegment> segments;
+    /* table in effect before segments[edit_segment], kept while edits stay on lines of text */
+    size_t edit_segment = 0;
+    std::shared_ptr<MacroTable> edit_macros;
+};
+
+IncrementalResult preprocess_incremental(std::string source, MacroTable predefined = MacroTable());
+void preprocess_edit(IncrementalResult &result, size_t offset, size_t removed, std::string_view inserted);
+
+
+#endif  // SRC_INCREMENTAL_H_
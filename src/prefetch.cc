@@ -0,0 +1,242 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 6502 C Compiler implementation.
+ *
+ * 6502 C Compiler is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * 6502 C Compiler is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the 6502 C Compiler. If not, see <https:// www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Include prefetching.
+ * 
+ * As soon as a source file is loaded its #include directives are pre-scanned and the
+ * files they name are queued to a background reader thread, which reads them (and, in
+ * turn, queues their includes) ahead of phase 4.  When phase 4 reaches the #include the
+ * contents are handed over from memory instead of being read synchronously.  Whatever a
+ * file queued but its phase 4 never claimed (an #include skipped by a conditional) is
+ * dropped once that phase 4 finishes, along with everything the dropped files queued in
+ * turn, so unused header trees are neither held nor read for the whole run.
+ */
+
+#include <string>
+#include <filesystem>
+#include <map>
+#include <vector>
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "helpers.h"
+#include "prefetch.h"
+
+struct PrefetchedFile {
+    bool ready = false;
+    bool failed = false;
+    std::string includer;  /* key of the file whose #include queued this one */
+    std::string contents;
+};
+
+std::filesystem::path prefetch_directory_;
+std::thread prefetch_thread_;
+std::mutex prefetch_mutex_;
+std::condition_variable prefetch_queued_;
+std::condition_variable prefetch_ready_;
+std::deque<std::string> prefetch_queue_;
+std::set<std::string> prefetch_seen_;                 /* every path ever queued */
+std::map<std::string, PrefetchedFile> prefetch_files_;  /* queued or read, not yet handed over */
+bool prefetch_running_ = false;
+
+std::string _prefetch_key(const std::filesystem::path &path) {
+    return path.lexically_normal().string();
+}
+
+/* Read a file through mmap, after asking the kernel to start readahead on all of it */
+bool _read_file_mapped(const std::string &filename, std::string &contents) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    contents.clear();
+    if (file_stat.st_size > 0) {
+        void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(mapped, file_stat.st_size, MADV_SEQUENTIAL);
+        contents.assign(static_cast<const char *>(mapped), file_stat.st_size);
+        munmap(mapped, file_stat.st_size);
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * Cheap scan for #include "..." lines.  This runs before phases 1-3, so it ignores comments,
+ * conditionals and trigraphs; a header fetched that is never included only costs the read.
+ * <...> names are recognised but skipped as there is no include search path yet.
+ */
+void _scan_includes(const std::string &buffer, std::vector<std::string> &found) {
+    size_t i = 0;
+    while (i < buffer.length()) {
+        while (i < buffer.length() && (buffer[i] == ' ' || buffer[i] == '\t')) i++;
+        if (i < buffer.length() && buffer[i] == '#') {
+            i++;
+            while (i < buffer.length() && (buffer[i] == ' ' || buffer[i] == '\t')) i++;
+            if (buffer.compare(i, 7, "include") == 0) {
+                i += 7;
+                while (i < buffer.length() && (buffer[i] == ' ' || buffer[i] == '\t')) i++;
+                if (i < buffer.length() && buffer[i] == '"') {
+                    size_t end = buffer.find_first_of("\"\n", i + 1);
+                    if (end != std::string::npos && buffer[end] == '"') {
+                        found.push_back(buffer.substr(i + 1, end - i - 1));
+                    }
+                }
+            }
+        }
+        i = buffer.find('\n', i);
+        if (i == std::string::npos) break;
+        i++;
+    }
+}
+
+/* Queue the includes found in the file includer, caller must hold prefetch_mutex_ */
+void _queue_includes(const std::vector<std::string> &found, const std::string &includer) {
+    for (const std::string &name : found) {
+        std::string key = _prefetch_key(prefetch_directory_ / name);
+        if (prefetch_seen_.insert(key).second) {
+            prefetch_files_[key].includer = includer;
+            prefetch_queue_.push_back(key);
+        }
+    }
+    if (!found.empty()) prefetch_queued_.notify_one();
+}
+
+void _prefetch_worker() {
+    std::unique_lock<std::mutex> lock(prefetch_mutex_);
+    while (true) {
+        prefetch_queued_.wait(lock, []{ return !prefetch_running_ || !prefetch_queue_.empty(); });
+        if (!prefetch_running_) return;
+
+        std::string key = prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+
+        /* read and scan unlocked, the lock is only held to publish the results */
+        lock.unlock();
+        std::string contents;
+        std::vector<std::string> found;
+        bool read = _read_file_mapped(key, contents);
+        if (read) _scan_includes(contents, found);
+        lock.lock();
+
+        auto entry = prefetch_files_.find(key);
+        if (entry == prefetch_files_.end()) continue;  // already handed over or released
+        entry->second.failed = !read;
+        entry->second.ready = true;
+        if (read) {
+            _queue_includes(found, key);
+            entry->second.contents = std::move(contents);
+        }
+        prefetch_ready_.notify_all();
+    }
+}
+
+void start_include_prefetcher(const std::filesystem::path &include_directory) {
+    prefetch_directory_ = include_directory;
+    prefetch_running_ = true;
+    prefetch_thread_ = std::thread(_prefetch_worker);
+}
+
+void stop_include_prefetcher() {
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex_);
+        prefetch_running_ = false;
+    }
+    prefetch_queued_.notify_all();
+    if (prefetch_thread_.joinable()) prefetch_thread_.join();
+}
+
+void prefetch_includes(const char *filename, const std::string &buffer) {
+    std::vector<std::string> found;
+    _scan_includes(buffer, found);
+
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    if (prefetch_running_) _queue_includes(found, _prefetch_key(filename));
+}
+
+/**
+ * Drop everything filename queued that has not been handed over, and what those queued in
+ * turn.  Called once phase 4 of filename is done, at which point any of its includes still
+ * held were never included, so neither will theirs be through them.
+ */
+void release_prefetched_includes(const char *filename) {
+    std::set<std::string> released{_prefetch_key(filename)};
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    bool dropped = true;
+    while (dropped) {
+        dropped = false;
+        for (auto entry = prefetch_files_.begin(); entry != prefetch_files_.end();) {
+            if (released.count(entry->second.includer)) {
+                released.insert(entry->first);
+                entry = prefetch_files_.erase(entry);
+                dropped = true;
+            }
+            else entry++;
+        }
+    }
+
+    /* not read yet, nothing is waiting for them any more */
+    prefetch_queue_.erase(std::remove_if(prefetch_queue_.begin(), prefetch_queue_.end(),
+                                         [&released](const std::string &key) { return released.count(key) > 0; }),
+                          prefetch_queue_.end());
+}
+
+/**
+ * Return the contents of filename, from the prefetcher when it has been queued there
+ * (waiting for the read to finish if it is in flight), otherwise read synchronously and
+ * queue the includes of the file that was just read.
+ */
+std::string read_source_file(const char *filename) {
+    std::string key = _prefetch_key(filename);
+    {
+        std::unique_lock<std::mutex> lock(prefetch_mutex_);
+        auto entry = prefetch_files_.find(key);
+        if (prefetch_running_ && entry != prefetch_files_.end()) {
+            prefetch_ready_.wait(lock, [&entry]{ return entry->second.ready || !prefetch_running_; });
+            if (entry->second.ready && !entry->second.failed) {
+                std::string contents = std::move(entry->second.contents);
+                prefetch_files_.erase(entry);
+                return contents;
+            }
+            prefetch_files_.erase(entry);
+        }
+    }
+
+    std::string contents = get_file_contents(filename);  /* throws errno on failure */
+    prefetch_includes(filename, contents);
+    return contents;
+}
@@ -0,0 +1,15 @@
+#ifndef SRC_PREFETCH_H_
+#define SRC_PREFETCH_H_
+
+#include <string>
+#include <filesystem>
+
+void start_include_prefetcher(const std::filesystem::path &include_directory);
+void stop_include_prefetcher();
+
+void prefetch_includes(const char *filename, const std::string &buffer);
+std::string read_source_file(const char *filename);
+void release_prefetched_includes(const char *filename);
+
+
+#endif  // SRC_PREFETCH_H_
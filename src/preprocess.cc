@@ -26,23 +26,35 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <stdexcept>
 #include <filesystem>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
 
 #include "language.h"
 #include "helpers.h"
+#include "prefetch.h"
+#include "token_cache.h"
+#include "preprocess.h"
+#include "configurations.h"
+#include "incremental.h"
 
 #define DEBUG 0
 #define TOKENIZATION_DEBUG 0
 
+#define DEFAULT_CACHE_SIZE_MB 256  /* --cache-size 0 never trims the cache */
+#define PARALLEL_TOKENIZE_MIN_BYTES (1 << 20)  /* smaller buffers are not worth the threads */
 
-std::string preproecess_file(char* filename);  /* forward delcaration */
 
 /* Global Variables */
 std::filesystem::path current_path_; /* Global variable for current directory */
-std::map<std::string, std::string> macros;
+size_t tokenize_chunks_ = 0;  /* when set, phase 3 always lexes in this many chunks (--lex-chunks) */
+MacroTable macros;
 
 void replace_digraphs(std::string &in_buffer) {
     for (int i = 1; i < in_buffer.length() - 1; i++) {
@@ -114,9 +126,17 @@ void splice_lines(std::string &in_buffer) {
     }
 }
 
-std::string tokenize(std::string &in_buffer) {
+/**
+ * Translation phase 3.  When unterminated is given, a comment block the buffer does not close
+ * is reported there instead of throwing, and the tokens up to the start of that line are returned.
+ */
+std::string tokenize(std::string_view in_buffer, UnterminatedComment *unterminated) {
     std::stringstream out_buffer;
-    std::stringstream token;
+    std::string_view token;  /* view into in_buffer, never copied */
+
+    /* last point tokenize was in its start of line state */
+    size_t line_start = 0;
+    std::streampos line_start_output = 0;
 
     bool preprocessor_directive = false;
     bool first_token_this_line = true;
@@ -143,11 +163,17 @@ std::string tokenize(std::string &in_buffer) {
                 while (i < in_buffer.length() && !(in_buffer[i-1]=='*' && in_buffer[i]=='/')){
                     i++;
                 }
-                if (in_buffer[i-1]=='*' && in_buffer[i]=='/') {
+                if (i < in_buffer.length() && in_buffer[i-1]=='*' && in_buffer[i]=='/') {
                     /* We did find the end of the comment block */
                     out_buffer << " ";  // replace comment with single space
                     continue; // skip rest of loop and start over
                 }
+                if (unterminated) {
+                    unterminated->found = true;
+                    unterminated->comment_start = start_position;
+                    unterminated->line_start = line_start;
+                    return out_buffer.str().substr(0, line_start_output);
+                }
                 message = "Comment block not terminated before end of buffer, started at ";
                 message.append(std::to_string(start_position));
                 throw std::invalid_argument(message);            
@@ -158,9 +184,13 @@ std::string tokenize(std::string &in_buffer) {
                 while (i < in_buffer.length() && in_buffer[i]!='\n'){
                     i++;
                 }
-                if (in_buffer[i] == '\n') {
+                if (i < in_buffer.length() && in_buffer[i] == '\n') {
                     /* we did find the end of line, thus ending the comment */
                     out_buffer << " \n"; // replace comment with single space, maintain newline
+                    preprocessor_directive = false;
+                    first_token_this_line = true;
+                    line_start = i + 1;
+                    line_start_output = out_buffer.tellp();
                     continue;
                 }
                 message = "Inline comment not terminated before end of buffer, started at ";
@@ -174,25 +204,25 @@ std::string tokenize(std::string &in_buffer) {
             out_buffer << "\n";
             preprocessor_directive = false;
             first_token_this_line = true;
+            line_start = i + 1;
+            line_start_output = out_buffer.tellp();
         }
 
         /* Process String Literal */
         else if (in_buffer[i] == '"') {
             debug_token_type = "String Literal";
             first_token_this_line = false;
-            token << "\"";
             start_position = i;
             i++;
-            while(i < in_buffer.length() && (in_buffer[i] != '"' || 
+            while(i < in_buffer.length() && in_buffer[i] != '\n' && (in_buffer[i] != '"' || 
                                             (in_buffer[i-1] == '\\' && in_buffer[i-2] != '\\')) ) {
-                token << in_buffer[i];
                 i++;
             }
-            token << "\"";
-            if (!is_valid_string_literal(token.str())) {
+            token = in_buffer.substr(start_position, i + 1 - start_position);
+            if (!is_valid_string_literal(token)) {
                 std::string message;
                 message = "Invalid string literal token ";
-                message.append(token.str());
+                message.append(token);
                 message.append(" found at ");
                 message.append(std::to_string(start_position));
                 throw std::invalid_argument(message);
@@ -204,18 +234,16 @@ std::string tokenize(std::string &in_buffer) {
         else if (preprocessor_directive and in_buffer[i] == '<') {
             debug_token_type = "Header Name";
             first_token_this_line = false;
-            token << "<";
             start_position = i;
             i++;
-            while(i < in_buffer.length() && (in_buffer[i] != '>' || in_buffer[i-1] == '\\') ) {
-                token << in_buffer[i];
+            while(i < in_buffer.length() && in_buffer[i] != '\n' && (in_buffer[i] != '>' || in_buffer[i-1] == '\\') ) {
                 i++;
             }
-            token << ">";
-            if (!is_valid_header_name(token.str())) {
+            token = in_buffer.substr(start_position, i + 1 - start_position);
+            if (!is_valid_header_name(token)) {
                 std::string message;
                 message = "Invalid header name token ";
-                message.append(token.str());
+                message.append(token);
                 message.append(" found at ");
                 message.append(std::to_string(start_position));
                 throw std::invalid_argument(message);
@@ -228,18 +256,16 @@ std::string tokenize(std::string &in_buffer) {
         else if (in_buffer[i] == '\'') {
             debug_token_type = "Character Literal";
             first_token_this_line = false;
-            token << "'";
             start_position = i;
             i++;
-            while(i < in_buffer.length() && (in_buffer[i] != '\'' || in_buffer[i-1] == '\\') ) {
-                token << in_buffer[i];
+            while(i < in_buffer.length() && in_buffer[i] != '\n' && (in_buffer[i] != '\'' || in_buffer[i-1] == '\\') ) {
                 i++;
             }
-            token << "'";
-            if (!is_valid_character_constant(token.str())) {
+            token = in_buffer.substr(start_position, i + 1 - start_position);
+            if (!is_valid_character_constant(token)) {
                 std::string message;
                 message = "Invalid character literal token ";
-                message.append(token.str());
+                message.append(token);
                 message.append(" found at ");
                 message.append(std::to_string(start_position));
                 throw std::invalid_argument(message);
@@ -250,12 +276,12 @@ std::string tokenize(std::string &in_buffer) {
         else if (is_char_a_non_digit(in_buffer[i])){
             debug_token_type = "Identifier";
             first_token_this_line = false;
-            token << in_buffer[i];
+            start_position = i;
             i++;
             while(i < in_buffer.length() && (is_char_a_non_digit(in_buffer[i]) || is_char_a_digit(in_buffer[i]))){
-                token << in_buffer[i];
                 i++;
             }
+            token = in_buffer.substr(start_position, i - start_position);
             if(i < in_buffer.length()){
                 i--;
             }
@@ -266,20 +292,19 @@ std::string tokenize(std::string &in_buffer) {
                     i+1 < in_buffer.length() && in_buffer[i] == '.' && is_char_a_digit(in_buffer[i+1])){
             debug_token_type = "PP-Number";
             first_token_this_line = false;
-            token << in_buffer[i];
+            start_position = i;
             i++;
             while(i < in_buffer.length() && (is_char_a_digit(in_buffer[i]) || 
                                                 is_char_a_non_digit(in_buffer[i]) ||
                                                 in_buffer[i] == '.')){
                 if((in_buffer[i] == 'e' || in_buffer[i] == 'E') && i + 1 < in_buffer.length()) {
                     if(in_buffer[i+1] == '+' || in_buffer[i+1] == '-') { //only time '+' or '-' permitted is after an 'e' or 'E'
-                        token << in_buffer[i];
                         i++;
                     }
                 }
-                token << in_buffer[i];
                 i++;                
             }
+            token = in_buffer.substr(start_position, i - start_position);
             i--;
         }
 
@@ -288,169 +313,393 @@ std::string tokenize(std::string &in_buffer) {
             int last_valid_token_character = -1;
             int first_character = i;            
             while(i < in_buffer.length() && not is_char_whitepsace(in_buffer[i])){
-                token << in_buffer[i];
-                if(is_token_an_operator(token.str().c_str()) || is_token_a_punctuator(token.str().c_str())) {
+                token = in_buffer.substr(first_character, i + 1 - first_character);
+                if(is_token_an_operator(token) || is_token_a_punctuator(token)) {
                     last_valid_token_character = i;
                 }                
                 i++;    
             }
             if (last_valid_token_character > -1) {
-                token.str(in_buffer.substr(first_character, last_valid_token_character+1-first_character));
+                token = in_buffer.substr(first_character, last_valid_token_character+1-first_character);
                 debug_token_type = "Operator/Punctuator";
                 i = last_valid_token_character;  //set this back to the end of the token!
             }
             else {
-                token.str(in_buffer.substr(first_character, 1));
+                token = in_buffer.substr(first_character, 1);
                 debug_token_type = "Other";
                 i = first_character; //set this back as the token is only one character!
             }
-            if(first_token_this_line && token.str() == "#"){
+            if(first_token_this_line && token == "#"){
                 preprocessor_directive = true;
             }
             first_token_this_line = false;
         }
 
-        if (token.str().length() > 0) {
+        if (token.length() > 0) {
             if (TOKENIZATION_DEBUG) {
                 if (preprocessor_directive) std::cout << "PPD ";
                 std::cout << debug_token_type;
-                std::cout << " : " << token.str() << std::endl;
+                std::cout << " : " << token << std::endl;
             }
-            out_buffer << " " << token.str();
-            token.str(std::string());
+            out_buffer << " " << token;
+            token = std::string_view();
         }
     }
     return out_buffer.str();
 }
 
 
-std::string execute_preprocessing_directives(std::string &in_buffer){
-    int i_start, i_end;
-    std::string line, token;
-    std::stringstream out_buffer;
+/* Result of lexing one chunk of a buffer on its own */
+struct TokenizedChunk {
+    std::string tokens;
+    UnterminatedComment unterminated;
+    bool failed = false;
+};
 
-    int preprocessing_conditional_depth = 0;
-    bool preprocessing_curent_conditional_false = false;
+void _tokenize_chunk(std::string_view chunk, TokenizedChunk &result) {
+    try {
+        result.tokens = tokenize(chunk, &result.unterminated);
+    }
+    catch (...) {
+        result.failed = true;
+    }
+}
 
-    i_start = 0;
-    i_end = in_buffer.find('\n', i_start);
-    while( i_end != in_buffer.npos) {  // got through, line by line
-        /* get line contents into line buffer */
-        line = in_buffer.substr(i_start, i_end - i_start);
-        int i = 0;
-        token = get_next_token(line, i);
-        if(token == "#") {
-            token = get_next_token(line, i);
-            if(token == "endif") {
-                preprocessing_curent_conditional_false = false;
-                preprocessing_conditional_depth--;
-                if(preprocessing_conditional_depth < 0) {
+/**
+ * Translation phase 3 for large buffers.  The buffer is cut at newlines into one chunk per
+ * core and every chunk is lexed in parallel, assuming it starts outside of a comment, which
+ * is the only lexer state that survives a newline.  A serial pass then stitches the chunks
+ * together: a chunk that leaves a comment block open is re-lexed from the start of that line
+ * up to the end of the chunk the comment closes in, and the chunks in between are dropped.
+ * Errors are reported by lexing the whole buffer serially, so they carry the right offsets.
+ * tokenize_chunks_ overrides the chunk count and the size threshold, for testing.
+ */
+std::string tokenize_parallel(std::string_view in_buffer) {
+    size_t chunk_count = std::thread::hardware_concurrency();
+    if (tokenize_chunks_ > 0) chunk_count = tokenize_chunks_;
+    else if (in_buffer.length() < PARALLEL_TOKENIZE_MIN_BYTES) return tokenize(in_buffer);
+    if (chunk_count < 2 || in_buffer.empty()) return tokenize(in_buffer);
+
+    std::vector<size_t> chunk_start;
+    size_t chunk_size = in_buffer.length() / chunk_count;
+    for (size_t start = 0; start < in_buffer.length(); ) {
+        chunk_start.push_back(start);
+        size_t end = in_buffer.find('\n', start + chunk_size);
+        start = end == std::string_view::npos ? in_buffer.length() : end + 1;
+    }
+    chunk_start.push_back(in_buffer.length());
+    chunk_count = chunk_start.size() - 1;
+
+    std::vector<TokenizedChunk> chunks(chunk_count);
+    std::vector<std::thread> threads;
+    for (size_t k = 0; k < chunk_count; k++) {
+        threads.emplace_back(_tokenize_chunk, in_buffer.substr(chunk_start[k], chunk_start[k+1] - chunk_start[k]),
+                             std::ref(chunks[k]));
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    std::string out_buffer;
+    size_t k = 0;
+    TokenizedChunk current = std::move(chunks[0]);
+    size_t current_start = 0;
+    while (true) {
+        if (current.failed) return tokenize(in_buffer);  /* throws with offsets into in_buffer */
+        out_buffer.append(current.tokens);
+        if (current.unterminated.found) {
+            /* tokenize() closes a comment at the first star-slash whose star follows the opening slash */
+            size_t comment_start = current_start + current.unterminated.comment_start;
+            size_t comment_end = in_buffer.find("*/", comment_start + 1);
+            if (comment_end == std::string_view::npos) return tokenize(in_buffer);
+            while (chunk_start[k+1] <= comment_end + 1) k++;
+
+            size_t restart = current_start + current.unterminated.line_start;
+            current = TokenizedChunk();
+            _tokenize_chunk(in_buffer.substr(restart, chunk_start[k+1] - restart), current);
+            current_start = restart;
+            continue;
+        }
+        if (++k == chunk_count) break;
+        current = std::move(chunks[k]);
+        current_start = chunk_start[k];
+    }
+    return out_buffer;
+}
+
+/**
+ * Memoized expansions that looked up identifier no longer hold once it is defined or
+ * undefined, nor does the memo of identifier itself.  Every other memo is left alone.
+ */
+void _invalidate_expansions(MacroTable &table, std::string_view identifier) {
+    auto entry = table.entries.find(identifier);
+    if (entry != table.entries.end()) {
+        entry->second.expansion_valid = false;
+        entry->second.lookups_valid = false;
+    }
+
+    auto dependents = table.dependents.find(identifier);
+    if (dependents == table.dependents.end()) return;
+    for (const std::string &dependent : dependents->second) {
+        auto dependent_entry = table.entries.find(dependent);
+        if (dependent_entry != table.entries.end()) {
+            dependent_entry->second.expansion_valid = false;
+            dependent_entry->second.lookups_valid = false;
+        }
+    }
+    table.dependents.erase(dependents);
+}
+
+void define_macro(MacroTable &table, std::string_view identifier, std::vector<std::string> replacement) {
+    _invalidate_expansions(table, identifier);
+    Macro &macro = table.entries[std::string(identifier)];
+    macro.replacement = std::move(replacement);
+    macro.expansion_valid = false;
+}
+
+void undefine_macro(MacroTable &table, std::string_view identifier) {
+    _invalidate_expansions(table, identifier);
+    auto entry = table.entries.find(identifier);
+    if (entry != table.entries.end()) table.entries.erase(entry);
+}
+
+/* expand_token(), recording every token looked up in the macro table when looked_up is given */
+void _expand_token(std::string_view token, MacroTable &table, std::vector<std::string_view> &hide_set,
+                   std::string &out, std::vector<std::string_view> *looked_up) {
+    if (looked_up) looked_up->push_back(token);
+    auto entry = table.entries.find(token);
+    if (entry == table.entries.end() || 
+            std::find(hide_set.begin(), hide_set.end(), token) != hide_set.end()) {
+        out.append(token);
+        out.push_back(' ');
+        return;
+    }
+
+    Macro &macro = entry->second;
+    bool memoize = hide_set.empty();
+    if (memoize && macro.expansion_valid) {
+        out.append(macro.expansion);
+        return;
+    }
+
+    std::vector<std::string_view> own_lookups;
+    std::vector<std::string_view> *lookups = memoize ? &own_lookups : looked_up;
+    size_t start = out.length();
+    hide_set.push_back(token);
+    for (const std::string &replacement_token : macro.replacement) {
+        _expand_token(replacement_token, table, hide_set, out, lookups);
+    }
+    hide_set.pop_back();
+
+    if (memoize) {
+        macro.expansion.assign(out, start, std::string::npos);
+        macro.expansion_valid = true;
+        std::sort(own_lookups.begin(), own_lookups.end());
+        own_lookups.erase(std::unique(own_lookups.begin(), own_lookups.end()), own_lookups.end());
+        macro.lookups.clear();
+        for (std::string_view identifier : own_lookups) {
+            if (identifier != token && is_char_a_non_digit(identifier[0])) {
+                macro.lookups.emplace_back(identifier);
+                table.dependents[std::string(identifier)].emplace(token);
+            }
+        }
+        macro.lookups_valid = true;
+    }
+}
+
+/**
+ * Identifiers that expanding the macro identifier from a line of text looks up, found without
+ * expanding it: they are the ones reachable through the replacement lists, as hide sets only
+ * stop a macro being entered twice on the same path.  Memoized like the expansion.
+ */
+const std::vector<std::string> &macro_lookups(MacroTable &table, std::string_view identifier) {
+    Macro &macro = table.entries.find(identifier)->second;
+    if (macro.lookups_valid) return macro.lookups;
+
+    std::set<std::string_view> reached{identifier};
+    std::vector<const Macro *> pending{&macro};
+    while (!pending.empty()) {
+        const Macro *current = pending.back();
+        pending.pop_back();
+        for (const std::string &token : current->replacement) {
+            if (!reached.insert(token).second) continue;
+            auto entry = table.entries.find(token);
+            if (entry != table.entries.end()) pending.push_back(&entry->second);
+        }
+    }
+
+    macro.lookups.clear();
+    for (std::string_view reached_identifier : reached) {
+        if (reached_identifier != identifier && is_char_a_non_digit(reached_identifier[0])) {
+            macro.lookups.emplace_back(reached_identifier);
+            table.dependents[std::string(reached_identifier)].emplace(identifier);
+        }
+    }
+    macro.lookups_valid = true;
+    return macro.lookups;
+}
+
+/**
+ * Write token to out, followed by a space, replacing it with its macro expansion if it
+ * names a macro in table.  The replacement list is rescanned for further macros; hide_set
+ * holds the macros currently being expanded so a macro that refers to itself, directly or
+ * through another macro, is left as is (X3.159-1989 sec. 3.8.3.4).
+ *
+ * The expansion of a macro reached from source text (empty hide_set) is memoized, along with
+ * the identifiers it looked up, and stays valid until one of those is defined or undefined.
+ */
+void expand_token(std::string_view token, MacroTable &table, std::vector<std::string_view> &hide_set,
+                  std::string &out) {
+    _expand_token(token, table, hide_set, out, nullptr);
+}
+
+/* Write line, which holds no directive, to out with its macros expanded */
+void expand_line(std::string_view line, MacroTable &table, std::string &out) {
+    std::vector<std::string_view> hide_set;
+    size_t i = 0;
+    std::string_view token = next_token(line, i);
+    while(token.length() > 0) {
+        expand_token(token, table, hide_set, out);
+        token = next_token(line, i);
+    }
+    out.push_back('\n');
+}
+
+/**
+ * Translation phase 4 for a single line of phase 3 output (without its newline), against the
+ * global macro table.  Whatever the line produces is appended to out.
+ */
+void execute_directive_line(std::string_view line, ConditionalState &conditional, std::string &out) {
+    size_t i = 0;
+    std::string_view token = next_token(line, i);
+    if(token == "#") {
+        token = next_token(line, i);
+        if(token == "endif") {
+            conditional.current_false = false;
+            conditional.depth--;
+            if(conditional.depth < 0) {
+                std::string message;
+                message = "\n";
+                message.append(line);
+                message.append("\n");
+                message.append("Unbalaced Pre-Processor Conditional:  #endif without corresponding conditional statement!");
+                throw std::invalid_argument(message);                     
+            }
+        }    
+        else if(!conditional.current_false) { /* if conditional include was flase, skip until #endif */
+            if(token == "include") {
+                token = next_token(line, i);
+                std::string filename;
+                if(token.length() > 0 && token[0] == '<'){
+                    /* sandard include */
+                }
+                else if(token.length() > 0 && token[0] == '"') {
+                    /* local include */
+                    filename = token.substr(1,token.length()-2);
+                }
+                else {
+                    /* macro replacement */
+                }
+                std::filesystem::path file_path = current_path_ / filename;
+                out.append(preproecess_file((char *)file_path.string().c_str()));
+            }
+            else if(token == "define") {
+                token = next_token(line, i);
+                if(!is_valid_identifier(token)){
                     std::string message;
                     message = "\n";
                     message.append(line);
                     message.append("\n");
-                    message.append("Unbalaced Pre-Processor Conditional:  #endif without corresponding conditional statement!");
-                    throw std::invalid_argument(message);                     
-                }
-            }    
-            else if(!preprocessing_curent_conditional_false) { /* if conditional include was flase, skip until #endif */
-                if(token == "include") {
-                    token = get_next_token(line, i);
-                    std::string filename;
-                    if(token[0] == '<'){
-                        /* sandard include */
-                    }
-                    else if(token[0] == '"') {
-                        /* local include */
-                        filename = token.substr(1,token.length()-2);
-                    }
-                    else {
-                        /* macro replacement */
-                    }
-                    std::filesystem::path file_path = current_path_ / filename;
-                    out_buffer << preproecess_file((char *)file_path.string().c_str());
-                }
-                else if(token == "define") {
-                    token = get_next_token(line, i);
-                    if(!is_valid_identifier(token)){
-                        std::string message;
-                        message = "\n";
-                        message.append(line);
-                        message.append("\n");
-                        message.append("Identifier Expected : ");
-                        message.append(token);
-                        throw std::invalid_argument(message); 
-                    }
-                    std::string identifier = token;
-                    token = get_next_token(line, i);
-                    macros[identifier] = token;
-                }
-                else if(token == "undef") {
-                    token = get_next_token(line, i);
-                    if(!is_valid_identifier(token)){
-                        std::string message;
-                        message = "\n";
-                        message.append(line);
-                        message.append("\n");
-                        message.append("Identifier Expected : ");
-                        message.append(token);
-                        throw std::invalid_argument(message); 
-                    }
-                    std::string identifier = token;
-                    macros.erase(identifier);
-                }            
-                else if(token == "ifdef") {
-                    token = get_next_token(line, i);
-                    preprocessing_curent_conditional_false = !macros.count(token);
-                    preprocessing_conditional_depth++; // add one to the current depth
+                    message.append("Identifier Expected : ");
+                    message.append(token);
+                    throw std::invalid_argument(message); 
                 }
-                else if(token == "ifndef") {
-                    token = get_next_token(line, i);
-                    preprocessing_curent_conditional_false = macros.count(token);
-                    preprocessing_conditional_depth++;
+                std::string_view identifier = token;
+                std::vector<std::string> replacement;
+                token = next_token(line, i);
+                while(token.length() > 0) {
+                    replacement.emplace_back(token);
+                    token = next_token(line, i);
                 }
-
-                else {
+                define_macro(macros, identifier, std::move(replacement));
+            }
+            else if(token == "undef") {
+                token = next_token(line, i);
+                if(!is_valid_identifier(token)){
                     std::string message;
-                    message = "Invalid preprocessing directive ";
-                    message.append(token);
-                    message.append("\n");
+                    message = "\n";
                     message.append(line);
-                    throw std::invalid_argument(message);                
+                    message.append("\n");
+                    message.append("Identifier Expected : ");
+                    message.append(token);
+                    throw std::invalid_argument(message); 
                 }
+                undefine_macro(macros, token);
+            }            
+            else if(token == "ifdef") {
+                token = next_token(line, i);
+                conditional.current_false = !macros.entries.count(token);
+                conditional.depth++; // add one to the current depth
+            }
+            else if(token == "ifndef") {
+                token = next_token(line, i);
+                conditional.current_false = macros.entries.count(token);
+                conditional.depth++;
             }
-        }
-        else if(!preprocessing_curent_conditional_false)  { /* if conditional include was flase, skip until #endif */
-            /* not a preprocessor directive */
 
-            while(token.length() > 0) {
-                if(macros.count(token) > 0) {
-                    out_buffer << macros[token] << " ";
-                }
-                else {
-                    out_buffer << token << " ";
-                }
-                token = get_next_token(line, i);
+            else {
+                std::string message;
+                message = "Invalid preprocessing directive ";
+                message.append(token);
+                message.append("\n");
+                message.append(line);
+                throw std::invalid_argument(message);                
             }
-            out_buffer << "\n";
         }
-
-        /* Get next line */
-        i_start = i_end + 1;
-        i_end = in_buffer.find('\n', i_start);
     }
-    if(preprocessing_conditional_depth != 0) {
+    else if(!conditional.current_false)  { /* if conditional include was flase, skip until #endif */
+        /* not a preprocessor directive */
+        expand_line(line, macros, out);
+    }
+}
+
+void check_conditionals_closed(const ConditionalState &conditional, std::string_view last_line) {
+    if(conditional.depth != 0) {
         std::string message;
         message = "\n";
-        message.append(line);
+        message.append(last_line);
         message.append("\n");
         message.append("Unbalaced Pre-Processor Conditional:  Missing #endif!");
         throw std::invalid_argument(message);                     
     }    
-    return out_buffer.str();
 }
 
-void preprocess(std::string &buffer) {
+std::string execute_preprocessing_directives(std::string &in_buffer){
+    size_t i_start, i_end;
+    std::string_view line;  /* view into in_buffer */
+    std::string out_buffer;
+    ConditionalState conditional;
+
+    i_start = 0;
+    i_end = in_buffer.find('\n', i_start);
+    while( i_end != in_buffer.npos) {  // got through, line by line
+        line = std::string_view(in_buffer).substr(i_start, i_end - i_start);
+        execute_directive_line(line, conditional, out_buffer);
+
+        /* Get next line */
+        i_start = i_end + 1;
+        i_end = in_buffer.find('\n', i_start);
+    }
+    check_conditionals_closed(conditional, line);
+    return out_buffer;
+}
+
+/* Translation phases 1-3, served from the token cache when it holds this source */
+void translate_to_tokens(std::string &buffer) {
+    TokenCacheKey cache_key;
+    if (token_cache_enabled()) {
+        cache_key = token_cache_key(buffer);
+        if (load_cached_tokens(cache_key, buffer)) return;
+    }
+
     /* Translation Phase 1 */
     replace_digraphs(buffer);
 
@@ -458,27 +707,126 @@ void preprocess(std::string &buffer) {
     splice_lines(buffer);
 
     /* Translation Phase 3 */
-    buffer = tokenize(buffer);
+    buffer = tokenize_parallel(buffer);
+
+    if (token_cache_enabled()) store_cached_tokens(cache_key, buffer);
+}
+
+void preprocess(std::string &buffer) {
+    /* Translation Phases 1-3 */
+    translate_to_tokens(buffer);
 
     /* Translation Phase 4 */
     buffer = execute_preprocessing_directives(buffer);
 }
 
 std::string preproecess_file(char* filename){
-    std::string buffer = get_file_contents(filename);
+    std::string buffer = read_source_file(filename);
     preprocess(buffer);
+    release_prefetched_includes(filename);
     return buffer;
 }
 
+/* A --edit option, applied with preprocess_edit() */
+struct SourceEdit {
+    size_t offset;
+    size_t removed;
+    std::string inserted;
+};
+
 int main(int argc, char* argv[]) {
     char* filename = argv[argc - 1];
 
+    /* options, the last argument is always the file to preprocess */
+    std::filesystem::path cache_directory;
+    uintmax_t cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+    Configuration common;  /* -D / -U before the first --config apply to every configuration */
+    std::vector<Configuration> configurations;
+    std::vector<SourceEdit> edits;
+    for (int arg = 1; arg < argc - 1; arg++) {
+        std::string option = argv[arg];
+        Configuration &configuration = configurations.empty() ? common : configurations.back();
+        if (option == "-D" && arg + 1 < argc - 1) {
+            add_definition(configuration, argv[++arg]);
+        }
+        else if (option.rfind("-D", 0) == 0 && option.length() > 2) {
+            add_definition(configuration, option.substr(2));
+        }
+        else if (option == "-U" && arg + 1 < argc - 1) {
+            add_undefinition(configuration, argv[++arg]);
+        }
+        else if (option.rfind("-U", 0) == 0 && option.length() > 2) {
+            add_undefinition(configuration, option.substr(2));
+        }
+        else if (option == "--config" && arg + 1 < argc - 1) {
+            configurations.push_back(common);
+            configurations.back().name = argv[++arg];
+        }
+        else if (option == "--edit" && arg + 3 < argc - 1) {
+            edits.push_back(SourceEdit{std::stoull(argv[arg + 1]), std::stoull(argv[arg + 2]), argv[arg + 3]});
+            arg += 3;
+        }
+        else if (option == "--lex-chunks" && arg + 1 < argc - 1) {
+            tokenize_chunks_ = std::stoull(argv[++arg]);
+        }
+        else if (option == "--cache-dir" && arg + 1 < argc - 1) {
+            cache_directory = argv[++arg];
+        }
+        else if (option == "--cache-size" && arg + 1 < argc - 1) {
+            cache_size_mb = std::stoull(argv[++arg]);
+        }
+        else {
+            std::string message;
+            message = "Invalid option ";
+            message.append(option);
+            throw std::invalid_argument(message);
+        }
+    }
+    if (!cache_directory.empty() && !set_token_cache_directory(cache_directory, cache_size_mb * 1024 * 1024)) {
+        std::cerr << "Warning: can not use token cache directory " << cache_directory.string() << std::endl;
+    }
+
     current_path_ = std::filesystem::path(filename);
     current_path_.remove_filename();
     // std::filesystem::path newpath;
     // newpath = current_path_ / "bob.txt";
 
+    if (!edits.empty() && !configurations.empty()) {
+        throw std::invalid_argument("--edit can not be combined with --config");
+    }
+
+    start_include_prefetcher(current_path_);
+    if (!edits.empty()) {
+        /* preprocess incrementally, then bring the output up to date after each edit in turn */
+        MacroTable predefined;
+        define_configuration_macros(common, predefined);
+        IncrementalResult result = preprocess_incremental(read_source_file(filename), std::move(predefined));
+        for (const SourceEdit &edit : edits) preprocess_edit(result, edit.offset, edit.removed, edit.inserted);
+        release_prefetched_includes(filename);
+        stop_include_prefetcher();
+        trim_token_cache();
+
+        std::cout << result.output << std::endl;
+        return 0;
+    }
+    if (!configurations.empty()) {
+        /* one output file per configuration, <name of file>.<configuration>.i */
+        std::vector<std::string> outputs = preprocess_configurations(filename, configurations);
+        stop_include_prefetcher();
+        trim_token_cache();
+
+        std::filesystem::path stem = std::filesystem::path(filename).stem();
+        for (size_t i = 0; i < configurations.size(); i++) {
+            std::ofstream out(stem.string() + "." + configurations[i].name + ".i");
+            out << outputs[i] << std::endl;
+        }
+        return 0;
+    }
+
+    define_configuration_macros(common, macros);
     std::string buffer = preproecess_file(filename);    
+    stop_include_prefetcher();
+    trim_token_cache();
 
     std::cout << buffer << std::endl;
 
@@ -0,0 +1,69 @@
+#ifndef SRC_PREPROCESS_H_
+#define SRC_PREPROCESS_H_
+
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <vector>
+
+/**
+ * Object-like macro.  The replacement list is captured once, as the phase 3 tokens that
+ * followed the identifier on the #define line, so expansion never has to re-lex it.
+ */
+struct Macro {
+    std::vector<std::string> replacement;
+    std::string expansion;         /* memoized full expansion, including trailing spaces */
+    bool expansion_valid = false;
+    std::vector<std::string> lookups;  /* memoized identifiers the expansion looks up, sorted */
+    bool lookups_valid = false;
+};
+
+struct MacroTable {
+    std::map<std::string, Macro, std::less<>> entries;  /* transparent, looked up by string_view */
+    /* identifier -> macros whose memoized expansion looked it up */
+    std::map<std::string, std::set<std::string, std::less<>>, std::less<>> dependents;
+};
+
+/* Phase 4 conditional inclusion state of the file being processed */
+struct ConditionalState {
+    int depth = 0;
+    bool current_false = false;
+};
+
+/* Where tokenize() stopped on a comment block the buffer does not close */
+struct UnterminatedComment {
+    bool found = false;
+    size_t comment_start;  /* offset of the opening / */
+    size_t line_start;     /* start of the line it is on, where tokenize() can be restarted */
+};
+
+/* Bump whenever phases 1-3 change their output, the token cache keys on it */
+#define TOKENIZER_VERSION "2"
+
+extern std::filesystem::path current_path_;
+extern MacroTable macros;
+extern size_t tokenize_chunks_;
+
+void replace_digraphs(std::string &in_buffer);
+void splice_lines(std::string &in_buffer);
+std::string tokenize(std::string_view in_buffer, UnterminatedComment *unterminated = nullptr);
+std::string tokenize_parallel(std::string_view in_buffer);
+void translate_to_tokens(std::string &buffer);
+
+void define_macro(MacroTable &table, std::string_view identifier, std::vector<std::string> replacement);
+void undefine_macro(MacroTable &table, std::string_view identifier);
+const std::vector<std::string> &macro_lookups(MacroTable &table, std::string_view identifier);
+void expand_token(std::string_view token, MacroTable &table, std::vector<std::string_view> &hide_set,
+                  std::string &out);
+void expand_line(std::string_view line, MacroTable &table, std::string &out);
+void execute_directive_line(std::string_view line, ConditionalState &conditional, std::string &out);
+void check_conditionals_closed(const ConditionalState &conditional, std::string_view last_line);
+std::string execute_preprocessing_directives(std::string &in_buffer);
+
+void preprocess(std::string &buffer);
+std::string preproecess_file(char* filename);
+
+
+#endif  // SRC_PREPROCESS_H_
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2024 Jim Haslett
+ *
+ * This file is part of the 6502 C Compiler implementation.
+ *
+ * 6502 C Compiler is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * 6502 C Compiler is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the 6502 C Compiler. If not, see <https:// www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Persistent token cache.
+ * 
+ * The output of translation phases 1-3 for a source file only depends on its contents, so
+ * it is stored on disk under a hash of those contents and reused by later runs.  Entries
+ * are written to a temporary file and renamed into place, so concurrent writers of the same
+ * key are safe, and the least recently used entries are removed once the cache directory
+ * grows past its size limit.
+ *
+ * Entry layout: the header line  TOKEN_CACHE_MAGIC <hash> <source size>\n  then the tokens.
+ */
+
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cinttypes>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "preprocess.h"
+#include "token_cache.h"
+
+/* Part of every key, so entries written by an older tokenizer are never hit */
+#define TOKEN_CACHE_VERSION "6502-pp-tokens-" TOKENIZER_VERSION
+#define TOKEN_CACHE_MAGIC "6502PPTOK"
+#define TOKEN_CACHE_EXTENSION ".tok"
+#define TOKEN_CACHE_TEMPORARY ".tok.tmp."
+#define TOKEN_CACHE_TEMPORARY_MAX_AGE std::chrono::hours(1)  /* older ones were left by a crashed run */
+
+std::filesystem::path token_cache_directory_;
+uintmax_t token_cache_size_limit_ = 0;
+unsigned long token_cache_temporary_count_ = 0;
+
+/**
+ * Cache phase 1-3 output in directory, creating it if needed.  A size_limit of 0 means the
+ * cache is never trimmed.  When the directory can not be created the cache stays disabled
+ * and false is returned, the run itself does not depend on it.
+ */
+bool set_token_cache_directory(const std::filesystem::path &directory, uintmax_t size_limit) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error || !std::filesystem::is_directory(directory, error)) return false;
+    token_cache_directory_ = directory;
+    token_cache_size_limit_ = size_limit;
+    return true;
+}
+
+bool token_cache_enabled() {
+    return !token_cache_directory_.empty();
+}
+
+/* 64 bit FNV-1a */
+uint64_t _fnv1a(uint64_t hash, std::string_view data) {
+    for (unsigned char character : data) {
+        hash ^= character;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+TokenCacheKey token_cache_key(std::string_view source) {
+    uint64_t hash = _fnv1a(0xcbf29ce484222325ULL, TOKEN_CACHE_VERSION);
+    hash = _fnv1a(hash, source);
+    return TokenCacheKey{hash, source.size()};
+}
+
+std::string _header(const TokenCacheKey &key) {
+    char header[64];
+    snprintf(header, sizeof(header), TOKEN_CACHE_MAGIC " %016" PRIx64 " %" PRIu64 "\n",
+             key.hash, key.source_size);
+    return header;
+}
+
+std::filesystem::path _entry_path(const TokenCacheKey &key) {
+    char name[64];
+    snprintf(name, sizeof(name), "%016" PRIx64 "-%" PRIx64 TOKEN_CACHE_EXTENSION,
+             key.hash, key.source_size);
+    return token_cache_directory_ / name;
+}
+
+/**
+ * Load the tokens stored for key through mmap.  A hit refreshes the entry's modification
+ * time, which is what trim_token_cache() orders entries by.
+ */
+bool load_cached_tokens(const TokenCacheKey &key, std::string &tokens) {
+    if (!token_cache_enabled()) return false;
+    std::filesystem::path path = _entry_path(key);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    std::string_view entry(static_cast<const char *>(mapped), file_stat.st_size);
+    std::string header = _header(key);
+    bool hit = entry.substr(0, header.length()) == header;
+    if (hit) tokens.assign(entry.substr(header.length()));
+    munmap(mapped, file_stat.st_size);
+
+    if (hit) {
+        std::error_code ignored;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ignored);
+    }
+    return hit;
+}
+
+/* Failing to store only costs the next run a cache miss, so errors are ignored */
+void store_cached_tokens(const TokenCacheKey &key, std::string_view tokens) {
+    if (!token_cache_enabled()) return;
+    std::filesystem::path path = _entry_path(key);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp." + std::to_string(getpid()) + "." + std::to_string(token_cache_temporary_count_++);
+
+    {
+        std::ofstream out(temporary, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out) return;
+        out << _header(key) << tokens;
+        out.close();
+        if (!out) {
+            std::error_code ignored;
+            std::filesystem::remove(temporary, ignored);
+            return;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) std::filesystem::remove(temporary, error);
+}
+
+struct _CacheEntry {
+    std::filesystem::path path;
+    std::filesystem::file_time_type last_used;
+    uintmax_t size;
+};
+
+/**
+ * Remove temporary files abandoned by runs that died mid-store, then the least recently used
+ * entries until the cache is back under its size limit.
+ */
+void trim_token_cache() {
+    if (!token_cache_enabled()) return;
+
+    std::vector<_CacheEntry> entries;
+    uintmax_t total = 0;
+    std::error_code error;
+    auto stale = std::filesystem::file_time_type::clock::now() - TOKEN_CACHE_TEMPORARY_MAX_AGE;
+    for (const auto &file : std::filesystem::directory_iterator(token_cache_directory_, error)) {
+        _CacheEntry entry{file.path(), file.last_write_time(error), file.file_size(error)};
+        if (error) continue;
+        if (file.path().filename().string().find(TOKEN_CACHE_TEMPORARY) != std::string::npos) {
+            if (entry.last_used < stale) std::filesystem::remove(entry.path, error);
+            continue;
+        }
+        if (file.path().extension() != TOKEN_CACHE_EXTENSION) continue;
+        total += entry.size;
+        entries.push_back(entry);
+    }
+    if (token_cache_size_limit_ == 0 || total <= token_cache_size_limit_) return;
+
+    std::sort(entries.begin(), entries.end(), [](const _CacheEntry &a, const _CacheEntry &b) {
+        return a.last_used < b.last_used;
+    });
+    for (const _CacheEntry &entry : entries) {
+        if (total <= token_cache_size_limit_) break;
+        if (std::filesystem::remove(entry.path, error)) total -= entry.size;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef SRC_TOKEN_CACHE_H_
+#define SRC_TOKEN_CACHE_H_
+
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <cstdint>
+
+struct TokenCacheKey {
+    uint64_t hash;
+    uint64_t source_size;
+};
+
+bool set_token_cache_directory(const std::filesystem::path &directory, uintmax_t size_limit);
+bool token_cache_enabled();
+TokenCacheKey token_cache_key(std::string_view source);
+bool load_cached_tokens(const TokenCacheKey &key, std::string &tokens);
+void store_cached_tokens(const TokenCacheKey &key, std::string_view tokens);
+void trim_token_cache();
+
+
+#endif  // SRC_TOKEN_CACHE_H_
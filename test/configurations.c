@@ -0,0 +1,21 @@
+/**
+ * Input for the configuration matrix test, see test-configurations in the Makefile
+ */
+
+#include "configurations.h"
+
+int common_start;
+int cpu = CPU_NAME;
+#ifdef DEBUG
+int debug_level = LEVEL;
+#endif
+#ifndef FAST
+int slow_path = CPU;
+#endif
+#define LEVEL 9
+int level = LEVEL;
+#undef FAST
+#ifdef FAST
+int never;
+#endif
+int width = WIDTH;
@@ -0,0 +1,7 @@
+#ifndef SRC_CONFIGURATIONS_H_
+#define SRC_CONFIGURATIONS_H_
+
+#define CPU_NAME cpu_ CPU
+#define BUS_WIDTH WIDTH
+int bus_width = BUS_WIDTH;
+#endif //SRC_CONFIGURATIONS_H_
@@ -0,0 +1,15 @@
+/**
+ * Input for the incremental preprocessing test, see test-incremental in the Makefile
+ */
+
+#include "test_include.h"
+
+#define WIDTH 8
+#define HEIGHT 6
+#define WIDE
+int area = WIDTH + 1 + HEIGHT;
+#ifdef WIDE
+int wide = WIDTH;
+#endif
+/* int perimeter = 2 * ( WIDTH + HEIGHT );
+int depth = 1; /* last line */
@@ -0,0 +1,30 @@
+/**
+ * Input for the parallel lexing test, see test-parallel in the Makefile.  Cut into
+ * enough chunks, the comment blocks below span chunk boundaries, some of them several.
+ */
+
+#include "test_include.h"
+
+#define OPEN "/*"
+#define CLOSE "*/"
+
+char *open = OPEN; /* a comment block
+                      opened after a literal that looks like one
+                      closes here */ char *close = CLOSE;
+
+// a line comment holding /* does not open a block
+int a = 1; /**/ int b = 2; /* // a line comment inside a block
+   */ int c = 3;
+
+/*
+ *
+ * a long comment
+ *
+ * spanning
+ *
+ * many lines
+ *
+ */
+int d = a * b / c;
+
+char e = '/'; char f = '*'; /* the last one closes on the last line */
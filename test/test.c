@@ -5,9 +5,13 @@
 #include "test_include.h"
 
 #define HELLO "Hello World\n"
+#define GREET fprint ( HELLO )
+#define LIMIT ( 12 + LIMIT )
 
 int main() {
     fprint(HELLO); //comment here 
+    GREET;
+    i = LIMIT;
     char bob = 'x'; \
     int i;
     i = i + 12e-3+56;